@@ -6,7 +6,6 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
-#include <alloca.h>
 
 #include "libmfs.h"
 
@@ -73,74 +72,17 @@ filesystem:\n\
     capacity_mb,metadata_mb,freemap_size);
 }
 
-static void dump_freemap(uint64_t size, void *ptr, struct mfs_super_block *sb)
+static void dump_freemap(const struct mfs_bitmap_stats *st, const struct mfs_super_block *sb)
 {
-    unsigned char *b = (unsigned char*) ptr;
-    unsigned char byte;
-    int i, j;
-
-    uint64_t used = 0,fragments = 0;
-    unsigned char laststate = 0;
-
-    for (i=size-1;i>=0;i--)
-    {
-        for (j=7;j>=0;j--)
-        {
-            byte = (b[i] >> j) & 1;
-            if(byte) {
-                used++;
-            }
-            if(laststate != byte && i!=(size-1) && j!=7) {
-                fragments++;
-            }
-            laststate = byte;
-        }
-    }
     fprintf(stderr,"freemap:\n\
     used bytes: %" PRIu64 "/%" PRIu64 " bytes\n\
     used blocks: %" PRIu64 "/%" PRIu64 " blocks )\n\
     usage: %3.02f%%\n\
     frag: %" PRIu64 "\n\
-",  used * sb->block_size, sb->block_size * sb->block_count,
-    used, sb->block_count,
-    100.0 / ( sb->block_count / used ),
-    fragments);
-}
-
-static int read_superblock(int fh, struct mfs_super_block *sb) 
-{
-    int err;
-
-    memset(sb,0,sizeof(struct mfs_super_block));
-
-    if( lseek(fh,MFS_SUPERBLOCK_BLOCK,SEEK_SET) == -1 ) {
-        fprintf(stderr,"cannot seek to superblock for reading %s\n",strerror(errno));
-    }
-
-    err = read_blockdevice(fh,sb,sizeof(struct mfs_super_block));
-    if( err != 0 ) {
-        return err;
-    }
-    return 0;
-}
-
-static int verify_magic_number(const struct mfs_super_block *sb)
-{
-    if( sb->magic != MFS_MAGIC_NUMBER ) {
-        fprintf(stderr,"wrong magic number for fs\n");
-        return 1;
-    }
-    return 0;
-}
-
-static int verify_version(const struct mfs_super_block *sb)
-{
-    if( MFS_GET_MAJOR_VERSION(sb->version) != MFS_GET_MAJOR_VERSION(MFS_VERSION) ||
-        MFS_GET_MINOR_VERSION(sb->version) != MFS_GET_MINOR_VERSION(MFS_VERSION) ) {
-        fprintf(stderr,"fs and userspace tools differ in version, please use up-to-date tools\n");
-        return 1;
-    }
-    return 0;
+",  st->used * sb->block_size, sb->block_size * sb->block_count,
+    st->used, sb->block_count,
+    ( 100.0 * st->used ) / sb->block_count,
+    st->fragments);
 }
 
 static int verify_filesystem(const struct mfs_fsck_config *conf) 
@@ -149,7 +91,8 @@ static int verify_filesystem(const struct mfs_fsck_config *conf)
     uint64_t bitmap_bytes;
     uint64_t bytes,blocks;
     struct mfs_super_block sb;
-    void *freemap;
+    struct mfs_bitmap_stats st;
+    void *freemap = NULL;
     
     if(conf->verbose) {
         fprintf(stderr,"opening block device %s\n",conf->device); }
@@ -194,16 +137,23 @@ static int verify_filesystem(const struct mfs_fsck_config *conf)
     }
 
     bitmap_bytes = BITS_TO_LONGS(sb.block_count) * sizeof(unsigned long);
-    freemap = alloca(bitmap_bytes);
-    
-    err = lseek(fh,sb.freemap_block * sb.block_size,SEEK_SET);
-    if( err == (off_t)-1) {
-        fprintf(stderr,"cannot find freemap");
-        err = EINVAL;
-        goto release;
+    memset(&st,0,sizeof(struct mfs_bitmap_stats));
+
+    if( conf->verbose > 1 ) {
+        // raw dump needs the whole freemap in memory
+        freemap = malloc(bitmap_bytes);
+        if(!freemap) {
+            fprintf(stderr,"cannot allocate freemap");
+            err = ENOMEM;
+            goto release;
+        }
+        err = read_sparse_blockdevice(fh,sb.freemap_block * sb.block_size,freemap,bitmap_bytes);
+        if(!err) {
+            count_bitmap(freemap,bitmap_bytes,&st); }
+    } else {
+        // holes in image files are counted as free without reading them
+        err = count_bitmap_blockdevice(fh,sb.freemap_block * sb.block_size,bitmap_bytes,&st);
     }
-
-    err = read_blockdevice(fh,freemap,bitmap_bytes);
     if(err) {
         fprintf(stderr,"cannot read freemap");
         err = EINVAL;
@@ -212,7 +162,7 @@ static int verify_filesystem(const struct mfs_fsck_config *conf)
 
     if(conf->verbose) {    
         dump_superblock(&sb);
-        dump_freemap(bitmap_bytes,freemap,&sb);
+        dump_freemap(&st,&sb);
         if( conf->verbose > 1 ) {
             fprintf(stderr,"freemap (raw):\n");
             print_bitmap(bitmap_bytes,freemap);
@@ -220,10 +170,13 @@ static int verify_filesystem(const struct mfs_fsck_config *conf)
     }
 
 release:
+    free(freemap);
     if(fh) {
         if(conf->verbose) {
             fprintf(stderr,"closing blockdevice %s\n",conf->device); }
-        err = close_blockdevice(fh);
+        // keep the first error, a clean close must not hide it
+        if( close_blockdevice(fh) != 0 && !err ) {
+            err = EIO; }
         if(conf->verbose) {
             fprintf(stderr,"blockdevice %s closed\n",conf->device); }
     }
@@ -1,13 +1,30 @@
+#define _GNU_SOURCE
+
 #include "libmfs.h"
 
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include <fs.h>
+#include <superblock.h>
+
+#define EXTENT_ITER_DENSE  0
+#define EXTENT_ITER_SEEK   1
+#define EXTENT_ITER_FIEMAP 2
+
+#define MAX_READ_CHUNK     (1 << 30)
+#define SCAN_CHUNK         (1 << 20)
+
+#define DEFAULT_SECTOR_SIZE 4096
 
 int open_blockdevice(const char *device, int *fh)
 {
@@ -26,6 +43,7 @@ int close_blockdevice(int fh)
         fprintf(stderr,"could not close block device: %s\n",strerror(errno));
         return errno;
     }
+    return 0;
 }
 
 int write_blockdevice(int fh,void *data,size_t datalen)
@@ -85,6 +103,77 @@ unsigned int sectorsize_blockdevice(int fh)
 
 }
 
+/* aligned buffer large enough to read the superblock from an O_DIRECT fd */
+int alloc_superblock_buffer(int fh, void **buf, size_t *buflen)
+{
+    unsigned int align = sectorsize_blockdevice(fh);
+    if(align == (unsigned int)-1 || align == 0) {
+        align = DEFAULT_SECTOR_SIZE; }
+
+    *buflen = ((sizeof(struct mfs_super_block) + align - 1) / align) * align;
+    if(posix_memalign(buf,align,*buflen) != 0) {
+        *buf = NULL;
+        return ENOMEM;
+    }
+    return 0;
+}
+
+int read_superblock_buffer(int fh, void *buf, size_t buflen, struct mfs_super_block *sb)
+{
+    ssize_t nread = pread(fh,buf,buflen,MFS_SUPERBLOCK_BLOCK);
+    if(nread == -1) {
+        return errno; }
+    if((size_t)nread < sizeof(struct mfs_super_block)) {
+        return EIO; }
+
+    if(buf != sb) {
+        memcpy(sb,buf,sizeof(struct mfs_super_block)); }
+    return 0;
+}
+
+int read_superblock(int fh, struct mfs_super_block *sb)
+{
+    int err;
+
+    memset(sb,0,sizeof(struct mfs_super_block));
+
+    err = read_superblock_buffer(fh,sb,sizeof(struct mfs_super_block),sb);
+    if( err != 0 ) {
+        fprintf(stderr,"cannot read superblock: %s\n",strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+int check_magic_number(const struct mfs_super_block *sb)
+{
+    return sb->magic != MFS_MAGIC_NUMBER;
+}
+
+int check_version(const struct mfs_super_block *sb)
+{
+    return MFS_GET_MAJOR_VERSION(sb->version) != MFS_GET_MAJOR_VERSION(MFS_VERSION) ||
+           MFS_GET_MINOR_VERSION(sb->version) != MFS_GET_MINOR_VERSION(MFS_VERSION);
+}
+
+int verify_magic_number(const struct mfs_super_block *sb)
+{
+    if( check_magic_number(sb) ) {
+        fprintf(stderr,"wrong magic number for fs\n");
+        return 1;
+    }
+    return 0;
+}
+
+int verify_version(const struct mfs_super_block *sb)
+{
+    if( check_version(sb) ) {
+        fprintf(stderr,"fs and userspace tools differ in version, please use up-to-date tools\n");
+        return 1;
+    }
+    return 0;
+}
+
 void print_bitmap(size_t const size, void const * const ptr)
 {
     unsigned char *b = (unsigned char*) ptr;
@@ -102,3 +191,253 @@ void print_bitmap(size_t const size, void const * const ptr)
     }
     fprintf(stderr,"\n");
 }
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+static inline void count_bitmap_word(unsigned long w, struct mfs_bitmap_stats *st)
+{
+    st->used      += __builtin_popcountl(w);
+    st->fragments += __builtin_popcountl((w ^ (w >> 1)) & (~0UL >> 1));
+    if(st->started && st->laststate != (int)(w & 1)) {
+        st->fragments++; }
+    st->started   = 1;
+    st->laststate = (int)(w >> (BITS_PER_LONG - 1));
+}
+
+void set_bits_bitmap(unsigned long *bitmap, uint64_t nbits)
+{
+    uint64_t full = nbits / BITS_PER_LONG;
+    uint64_t rest = nbits % BITS_PER_LONG;
+
+    memset(bitmap,0xff,full * sizeof(unsigned long));
+    if(rest) {
+        bitmap[full] |= (1UL << rest) - 1; }
+}
+
+void count_bitmap(const void *bitmap, size_t size, struct mfs_bitmap_stats *st)
+{
+    const unsigned long *words = bitmap;
+
+    for(size_t i = 0; i < size / sizeof(unsigned long); i++) {
+        count_bitmap_word(words[i],st); }
+}
+
+/* a hole is all zero bits: nothing used, at most one transition into it */
+void count_bitmap_hole(size_t size, struct mfs_bitmap_stats *st)
+{
+    if(!size) {
+        return; }
+    if(st->started && st->laststate) {
+        st->fragments++; }
+    st->started   = 1;
+    st->laststate = 0;
+}
+
+static int fiemap_first_extent(int fh, off_t pos, off_t len, struct fiemap_extent *fe, int *found)
+{
+    char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    struct fiemap *fm = (struct fiemap*) buf;
+
+    memset(buf,0,sizeof(buf));
+    fm->fm_start        = pos;
+    fm->fm_length       = len;
+    fm->fm_flags        = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = 1;
+
+    if( ioctl(fh,FS_IOC_FIEMAP,fm) == -1 ) {
+        return errno; }
+
+    *found = fm->fm_mapped_extents > 0;
+    if(*found) {
+        memcpy(fe,&fm->fm_extents[0],sizeof(struct fiemap_extent)); }
+    return 0;
+}
+
+int extent_iter_init(struct mfs_extent_iter *it, int fh, off_t offset, off_t length)
+{
+    struct stat st;
+    struct fiemap_extent fe;
+    int found;
+
+    memset(it,0,sizeof(struct mfs_extent_iter));
+    it->fh     = fh;
+    it->pos    = offset;
+    it->end    = offset + length;
+    it->size   = it->end;
+    it->sparse = EXTENT_ITER_DENSE;
+
+    if( fstat(fh,&st) != 0 ) {
+        fprintf(stderr,"could not stat device: %s\n",strerror(errno));
+        return errno;
+    }
+    if( !S_ISREG(st.st_mode) ) {
+        return 0; }
+
+    // missing data past eof is not known to be zero
+    if( it->end > st.st_size ) {
+        fprintf(stderr,"device is truncated: need %lld bytes, has %lld\n",(long long)it->end,(long long)st.st_size);
+        return EIO;
+    }
+    it->size = st.st_size;
+
+    if( lseek(fh,offset,SEEK_DATA) != (off_t)-1 || errno == ENXIO ) {
+        it->sparse = EXTENT_ITER_SEEK;
+    } else if( fiemap_first_extent(fh,offset,length,&fe,&found) == 0 ) {
+        it->sparse = EXTENT_ITER_FIEMAP;
+    }
+    return 0;
+}
+
+static void set_extent(struct mfs_extent_iter *it, struct mfs_extent *ext, off_t end, int hole)
+{
+    if(end > it->end) {
+        end = it->end; }
+    // fiemap extents are rounded up to whole blocks and may reach past eof
+    if(end > it->size) {
+        end = it->size; }
+    ext->offset = it->pos;
+    ext->length = end - it->pos;
+    ext->hole   = hole;
+    it->pos     = end;
+}
+
+int extent_iter_next(struct mfs_extent_iter *it, struct mfs_extent *ext)
+{
+    off_t data, hole;
+    struct fiemap_extent fe;
+    int err, found;
+
+    memset(ext,0,sizeof(struct mfs_extent));
+    if(it->pos >= it->end) {
+        return 0; }
+
+    switch(it->sparse) {
+    case EXTENT_ITER_SEEK:
+        data = lseek(it->fh,it->pos,SEEK_DATA);
+        if(data == (off_t)-1) {
+            if(errno != ENXIO) {
+                fprintf(stderr,"could not seek to data: %s\n",strerror(errno));
+                return errno; }
+            // only a trailing hole is left, the range was checked against eof
+            set_extent(it,ext,it->end,1);
+        } else if(data > it->pos) {
+            set_extent(it,ext,data,1);
+        } else {
+            hole = lseek(it->fh,it->pos,SEEK_HOLE);
+            if(hole == (off_t)-1) {
+                fprintf(stderr,"could not seek to hole: %s\n",strerror(errno));
+                return errno; }
+            set_extent(it,ext,hole,0);
+        }
+        break;
+    case EXTENT_ITER_FIEMAP:
+        err = fiemap_first_extent(it->fh,it->pos,it->end - it->pos,&fe,&found);
+        if(err) {
+            fprintf(stderr,"could not map extents: %s\n",strerror(err));
+            return err; }
+        if(!found) {
+            set_extent(it,ext,it->end,1);
+        } else if((off_t)fe.fe_logical > it->pos) {
+            set_extent(it,ext,fe.fe_logical,1);
+        } else {
+            // unwritten (preallocated) extents read back as zeros
+            set_extent(it,ext,fe.fe_logical + fe.fe_length,(fe.fe_flags & FIEMAP_EXTENT_UNWRITTEN) != 0);
+        }
+        break;
+    default:
+        set_extent(it,ext,it->end,0);
+        break;
+    }
+    return 0;
+}
+
+int read_sparse_blockdevice(int fh, off_t offset, void *data, size_t datalen)
+{
+    struct mfs_extent_iter it;
+    struct mfs_extent ext;
+    unsigned char *buf = data;
+    off_t chunk;
+    int err;
+
+    err = extent_iter_init(&it,fh,offset,datalen);
+    if(err) {
+        return err; }
+
+    for(;;) {
+        err = extent_iter_next(&it,&ext);
+        if(err) {
+            return err; }
+        if(!ext.length) {
+            break; }
+
+        if(ext.hole) {
+            memset(buf + (ext.offset - offset),0,ext.length);
+            continue;
+        }
+
+        if( lseek(fh,ext.offset,SEEK_SET) == (off_t)-1 ) {
+            fprintf(stderr,"could not seek on blockdevice: %s\n",strerror(errno));
+            return errno; }
+        for(off_t done = 0; done < ext.length; done += chunk) {
+            chunk = ext.length - done;
+            if(chunk > MAX_READ_CHUNK) {
+                chunk = MAX_READ_CHUNK; }
+            err = read_blockdevice(fh,buf + (ext.offset - offset) + done,chunk);
+            if(err) {
+                return err; }
+        }
+    }
+    return 0;
+}
+
+int count_bitmap_blockdevice(int fh, off_t offset, size_t size, struct mfs_bitmap_stats *st)
+{
+    struct mfs_extent_iter it;
+    struct mfs_extent ext;
+    unsigned char *buf;
+    off_t chunk;
+    int err;
+
+    err = extent_iter_init(&it,fh,offset,size);
+    if(err) {
+        return err; }
+
+    buf = malloc(SCAN_CHUNK);
+    if(!buf) {
+        return ENOMEM; }
+
+    for(;;) {
+        err = extent_iter_next(&it,&ext);
+        if(err || !ext.length) {
+            break; }
+
+        if(ext.hole) {
+            count_bitmap_hole(ext.length,st);
+            continue;
+        }
+
+        // data extents normally start and end on filesystem block boundaries,
+        // anything else would make count_bitmap() drop trailing bytes
+        if( ((ext.offset - offset) % sizeof(unsigned long)) != 0 ||
+            (ext.length % sizeof(unsigned long)) != 0 ) {
+            fprintf(stderr,"bitmap extent at %lld (+%lld) is not word aligned\n",(long long)ext.offset,(long long)ext.length);
+            err = EINVAL;
+            break; }
+        if( lseek(fh,ext.offset,SEEK_SET) == (off_t)-1 ) {
+            fprintf(stderr,"could not seek on blockdevice: %s\n",strerror(errno));
+            err = errno;
+            break; }
+        for(off_t done = 0; done < ext.length && !err; done += chunk) {
+            chunk = ext.length - done;
+            if(chunk > SCAN_CHUNK) {
+                chunk = SCAN_CHUNK; }
+            err = read_blockdevice(fh,buf,chunk);
+            if(!err) {
+                count_bitmap(buf,chunk,st); }
+        }
+        if(err) {
+            break; }
+    }
+    free(buf);
+    return err;
+}
@@ -2,14 +2,60 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #define MAX_LEN_DEVICENAME 255
 typedef uint64_t sector_t;
 
+struct mfs_super_block;
+
 int open_blockdevice(const char *device, int *fh);
 int close_blockdevice(int fh);
 int write_blockdevice(int fh,void *data,size_t datalen);
 int read_blockdevice(int fh,void *data, size_t datalen);
 uint64_t bytecount_blockdevice(int fh);
 unsigned int sectorsize_blockdevice(int fh);
+int alloc_superblock_buffer(int fh, void **buf, size_t *buflen);
+int read_superblock_buffer(int fh, void *buf, size_t buflen, struct mfs_super_block *sb);
+int read_superblock(int fh, struct mfs_super_block *sb);
+/* silent checks, return non-zero on mismatch */
+int check_magic_number(const struct mfs_super_block *sb);
+int check_version(const struct mfs_super_block *sb);
+int verify_magic_number(const struct mfs_super_block *sb);
+int verify_version(const struct mfs_super_block *sb);
 void print_bitmap(size_t const size, void const * const ptr);
+
+/* one contiguous range of a device, either backed by data or a hole (known zero) */
+struct mfs_extent {
+    off_t offset;
+    off_t length;
+    int   hole;
+};
+
+/* walks [offset,offset+length) of a device in data/hole extents.
+   regular files are probed with SEEK_DATA/SEEK_HOLE (FIEMAP as fallback),
+   anything else is reported as a single data extent.
+   a range reaching past the end of a regular file is an error, not a hole */
+struct mfs_extent_iter {
+    int   fh;
+    off_t pos;
+    off_t end;
+    off_t size;
+    int   sparse;
+};
+
+struct mfs_bitmap_stats {
+    uint64_t used;
+    uint64_t fragments;
+    int      started;
+    int      laststate;
+};
+
+void set_bits_bitmap(unsigned long *bitmap, uint64_t nbits);
+void count_bitmap(const void *bitmap, size_t size, struct mfs_bitmap_stats *st);
+void count_bitmap_hole(size_t size, struct mfs_bitmap_stats *st);
+
+int extent_iter_init(struct mfs_extent_iter *it, int fh, off_t offset, off_t length);
+int extent_iter_next(struct mfs_extent_iter *it, struct mfs_extent *ext);
+int read_sparse_blockdevice(int fh, off_t offset, void *data, size_t datalen);
+int count_bitmap_blockdevice(int fh, off_t offset, size_t size, struct mfs_bitmap_stats *st);
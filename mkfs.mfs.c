@@ -109,16 +109,6 @@ static int create_superblock(const struct mfs_mkfs_config *conf,struct mfs_super
     return 0;
 }
 
-static void set_bit_bitmap(unsigned long *bitmap,size_t bit) 
-{
-    size_t lpos = bit / (sizeof(unsigned long)*8);
-    size_t bpos = bit % (sizeof(unsigned long)*8);
-    unsigned long mask = 1 << bit;
-
-    unsigned long *bits = &bitmap[lpos];
-    (*bits) = (*bits) | mask;
-}
-
 static unsigned long *create_zero_bitmap(int fh,uint64_t bits) 
 {
     unsigned long *bitmap = calloc(BITS_TO_LONGS(bits),sizeof(unsigned long));
@@ -144,8 +134,7 @@ static int write_freemap(int fh,uint64_t bits,uint32_t block_size)
     if(!bitmap) {
         return -ENOMEM; }
 
-    for(size_t b = 0; b < used_blocks; b++) {
-        set_bit_bitmap(bitmap,b); }
+    set_bits_bitmap(bitmap,used_blocks);
 
 #ifdef _DEBUG_MKFS_MFS
     print_bitmap(BITS_TO_LONGS(bits)*sizeof(unsigned long),bitmap);
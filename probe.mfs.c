@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "libmfs.h"
+
+#include <fs.h>
+#include <superblock.h>
+
+#define BITS_PER_BYTE           8
+#define DIV_ROUND_UP(n,d)       (((n) + (d) - 1) / (d))
+#define BITS_TO_LONGS(nr)       DIV_ROUND_UP(nr, BITS_PER_BYTE * sizeof(long))
+
+static struct option long_options[] = {
+    {"device"   , required_argument, 0, 'd'},
+    {"interval" , required_argument, 0, 'i'},
+    {"usage"    , no_argument      , 0, 'u'},
+    {"help"     , no_argument      , 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+struct mfs_probe_config {
+    int usage;
+    unsigned int interval;
+    char device[MAX_LEN_DEVICENAME];
+};
+
+/* state kept open across polls */
+struct mfs_probe {
+    int fh;
+    void *buf;
+    size_t buflen;
+
+    int usage_fh;
+    int usage_valid;
+    uint64_t usage_mount_cnt;
+    struct mfs_bitmap_stats usage;
+};
+
+static volatile sig_atomic_t stop_probe = 0;
+
+static void show_usage(const char *executable) {
+    printf("\
+usage: %s -d <devicename> [-i <seconds>] [-u]\n\n\
+read-only health probe of a mfs filesystem, prints one json line per poll\n\
+version %lu.%lu\n\
+    -d <device>   : blockdevice name\n\
+    -i <seconds>  : poll every <seconds> until interrupted (default: probe once)\n\
+    -u            : include freemap usage, the freemap is rescanned only when\n\
+                    the mount count changes (full rescan of its data, holes skipped)\n\
+    -h            : help\n\
+",executable,MFS_GET_MAJOR_VERSION(MFS_VERSION),MFS_GET_MINOR_VERSION(MFS_VERSION));
+}
+
+static void handle_signal(int sig)
+{
+    stop_probe = 1;
+}
+
+static void print_json_string(const char *str)
+{
+    putchar('"');
+    for(; *str; str++) {
+        if(*str == '"' || *str == '\\') {
+            printf("\\%c",*str);
+        } else if((unsigned char)*str < 0x20) {
+            printf("\\u%04x",(unsigned char)*str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+static void close_probe(struct mfs_probe *probe)
+{
+    if(probe->fh >= 0) {
+        close(probe->fh);
+        probe->fh = -1; }
+    if(probe->usage_fh >= 0) {
+        close(probe->usage_fh);
+        probe->usage_fh = -1; }
+    free(probe->buf);
+    probe->buf = NULL;
+    probe->usage_valid = 0;
+}
+
+static int open_probe(const struct mfs_probe_config *conf, struct mfs_probe *probe)
+{
+    int err;
+
+    // O_DIRECT is not supported everywhere (e.g. tmpfs), fall back to buffered reads
+    probe->fh = open(conf->device,O_RDONLY | O_DIRECT);
+    if(probe->fh < 0 && errno == EINVAL) {
+        probe->fh = open(conf->device,O_RDONLY); }
+    if(probe->fh < 0) {
+        return errno; }
+
+    err = alloc_superblock_buffer(probe->fh,&probe->buf,&probe->buflen);
+    if(err) {
+        close_probe(probe); }
+    return err;
+}
+
+static int refresh_usage(const struct mfs_probe_config *conf, struct mfs_probe *probe, const struct mfs_super_block *sb)
+{
+    struct mfs_bitmap_stats usage;
+    uint64_t bitmap_bytes;
+    int err;
+
+    if(probe->usage_valid && probe->usage_mount_cnt == sb->mount_cnt) {
+        return 0; }
+
+    // the freemap length is not sector aligned, so it is read through a buffered fd
+    if(probe->usage_fh < 0) {
+        probe->usage_fh = open(conf->device,O_RDONLY);
+        if(probe->usage_fh < 0) {
+            return errno; }
+    }
+
+    // rescans all data extents of the freemap, holes are counted without reading
+    bitmap_bytes = BITS_TO_LONGS(sb->block_count) * sizeof(unsigned long);
+    memset(&usage,0,sizeof(struct mfs_bitmap_stats));
+    err = count_bitmap_blockdevice(probe->usage_fh,sb->freemap_block * sb->block_size,bitmap_bytes,&usage);
+    if(!err) {
+        probe->usage = usage;
+        probe->usage_mount_cnt = sb->mount_cnt;
+        probe->usage_valid = 1;
+    }
+    return err;
+}
+
+static int probe_filesystem(const struct mfs_probe_config *conf, struct mfs_probe *probe)
+{
+    struct mfs_super_block sb;
+    int err = 0;
+
+    if(probe->fh < 0) {
+        err = open_probe(conf,probe); }
+    if(!err) {
+        err = read_superblock_buffer(probe->fh,probe->buf,probe->buflen,&sb); }
+
+    printf("{\"time\":%lld,\"device\":",(long long)time(0));
+    print_json_string(conf->device);
+
+    if(err) {
+        printf(",\"error\":");
+        print_json_string(strerror(err));
+        printf("}\n");
+        fflush(stdout);
+        // reopen on next poll, the device may have been replaced
+        close_probe(probe);
+        return err;
+    }
+
+    printf(",\"magic\":\"0x%" PRIx64 "\",\"magic_ok\":%s,\"version\":\"%lu.%lu\",\"version_ok\":%s,\
+\"block_size\":%" PRIu32 ",\"block_count\":%" PRIu64 ",\"next_ino\":%" PRIu64 ",\"mounted\":%u,\"mount_cnt\":%" PRIu64,
+        sb.magic, check_magic_number(&sb) ? "false" : "true",
+        MFS_GET_MAJOR_VERSION(sb.version),MFS_GET_MINOR_VERSION(sb.version),
+        check_version(&sb) ? "false" : "true",
+        sb.block_size,sb.block_count,sb.next_ino,sb.mounted,sb.mount_cnt);
+
+    if(conf->usage) {
+        if( !check_magic_number(&sb) && (err = refresh_usage(conf,probe,&sb)) == 0 ) {
+            printf(",\"usage\":{\"used_blocks\":%" PRIu64 ",\"free_blocks\":%" PRIu64 ",\"fragments\":%" PRIu64 ",\"mount_cnt\":%" PRIu64 "}",
+                probe->usage.used,sb.block_count - probe->usage.used,
+                probe->usage.fragments,probe->usage_mount_cnt);
+        } else {
+            printf(",\"usage\":null");
+        }
+    }
+
+    printf("}\n");
+    fflush(stdout);
+    return err;
+}
+
+static int parse_commandline(int argc,char ** argv, struct mfs_probe_config *config)
+{
+    int c;
+    int option_index = 0;
+    char *end;
+    while( (c = getopt_long(argc, argv, "d:i:hu",long_options, &option_index)) != -1 ) {
+        switch(c) {
+        case 'h':
+            show_usage(argv[0]);
+            exit(0);
+        case 'u':
+            config->usage = 1;
+            break;
+        case 'i':
+            config->interval = strtoul(optarg,&end,10);
+            if(!optarg[0] || *end) {
+                fprintf(stderr,"invalid interval in -i <seconds>\n");
+                return -EINVAL;
+            }
+            break;
+        case 'd':
+            if(!optarg) {
+                fprintf(stderr,"no device found in -d <device>\n");
+                return -EINVAL;
+            }
+            if(strlen(optarg) > (MAX_LEN_DEVICENAME - 1)) {
+                fprintf(stderr,"device name too long in -d <device>\n");
+                return -EINVAL;
+            }
+            config->device[0] = 0;
+            strncat(config->device,optarg,MAX_LEN_DEVICENAME-1);
+            break;
+        case '?':
+        default:
+            fprintf(stderr,"unknown error while parsing command line arguments\n");
+            return 1;
+        }
+    }
+
+    if(!config->device[0]) {
+        fprintf(stderr,"no device given, please specify -d <device>\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc,char ** argv)
+{
+    struct mfs_probe_config conf;
+    struct mfs_probe probe;
+    int err = 0;
+    memset(&conf,0,sizeof(struct mfs_probe_config));
+    memset(&probe,0,sizeof(struct mfs_probe));
+    probe.fh = -1;
+    probe.usage_fh = -1;
+
+    err = parse_commandline(argc,argv,&conf);
+    if( err != 0 ) {
+        goto release; }
+
+    signal(SIGINT,handle_signal);
+    signal(SIGTERM,handle_signal);
+
+    do {
+        err = probe_filesystem(&conf,&probe);
+        if(conf.interval && !stop_probe) {
+            sleep(conf.interval); }
+    } while(conf.interval && !stop_probe);
+
+release:
+    close_probe(&probe);
+    return err;
+}